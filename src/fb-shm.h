@@ -0,0 +1,95 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+/*
+ * Shared memory frame export.
+ *
+ * When started with -s path, the server listens on the Unix stream socket at
+ * path, which only the user running the server may connect to. Each process
+ * connecting to it receives a single byte carrying two file descriptors
+ * (SCM_RIGHTS): a read-only memfd holding the frame, and a blocking eventfd
+ * of its own that is signalled after every update. The memfd is sealed
+ * against resizing, so it is safe to map it whole, and on Linux 5.1 and
+ * later against writes by anyone but the server. Keep the socket open for as
+ * long as updates are wanted; closing it unsubscribes.
+ *
+ * The memfd starts with a struct fb_shm_header. The frame follows at
+ * frame_offset, height rows of stride bytes, in the same pixel format the
+ * server sends to VNC clients (described by the *_max and *_shift fields).
+ * Rows are padded to a multiple of 4 bytes, so stride can be more than
+ * width * bytes_per_pixel.
+ *
+ * seq is a sequence lock. It is odd while the server is writing the frame,
+ * and even otherwise; seq / 2 is the number of the last complete frame. To
+ * read a consistent frame:
+ *
+ *     do {
+ *         while ((s1 = __atomic_load_n(&hdr->seq, __ATOMIC_ACQUIRE)) & 1)
+ *             ;
+ *         ... copy the pixels and ring entries needed ...
+ *         __atomic_thread_fence(__ATOMIC_ACQUIRE);
+ *         s2 = __atomic_load_n(&hdr->seq, __ATOMIC_RELAXED);
+ *     } while (s1 != s2);
+ *
+ * The fence keeps the copy from being reordered after the second load of
+ * seq; without it the check is not reliable on weakly ordered CPUs such as
+ * ARM. Only use the copy once the loop has finished.
+ *
+ * Each update adds one or more entries to the damage ring, at index
+ * (entry number % FB_SHM_RING_SIZE), tagged with the frame they belong to.
+ * A reader that last saw frame n can repaint only the damage of frames after
+ * n, provided all of them are still in the ring; otherwise it should take
+ * the whole frame.
+ */
+
+#ifndef FB_SHM_H
+#define FB_SHM_H
+
+#include <stdint.h>
+
+#define FB_SHM_MAGIC        0x4d485346  /* "FSHM" */
+#define FB_SHM_VERSION      1
+#define FB_SHM_RING_SIZE    64
+
+struct fb_shm_rect
+{
+    uint64_t frame;         /* frame number this damage belongs to */
+    uint16_t x, y;
+    uint16_t w, h;
+};
+
+struct fb_shm_header
+{
+    uint32_t magic;
+    uint32_t version;
+
+    uint32_t width;
+    uint32_t height;
+    uint32_t bytes_per_pixel;
+    uint32_t stride;        /* bytes per row, including padding */
+    uint32_t frame_offset;  /* of the pixels, from the start of the memfd */
+    uint32_t ring_size;     /* FB_SHM_RING_SIZE */
+
+    uint16_t red_max;
+    uint16_t green_max;
+    uint16_t blue_max;
+    uint8_t red_shift;
+    uint8_t green_shift;
+    uint8_t blue_shift;
+    uint8_t reserved[7];
+
+    uint64_t seq;           /* sequence lock, see above */
+    uint64_t ring_head;     /* number of damage entries ever written */
+    struct fb_shm_rect ring[FB_SHM_RING_SIZE];
+};
+
+#endif /* FB_SHM_H */
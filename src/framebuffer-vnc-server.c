@@ -15,6 +15,8 @@
  * and Zaurus.
  */
 
+#define _GNU_SOURCE                     /* For memfd_create() */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -22,6 +24,10 @@
 #include <unistd.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
 
 #include <sys/stat.h>
 #include <sys/sysmacros.h>             /* For makedev() */
@@ -32,10 +38,27 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+
+#include <zlib.h>
 
 /* libvncserver */
 #include "rfb/rfb.h"
 
+#include "fb-shm.h"
+
+/* Static tracepoints for perf and bpftrace, e.g.
+ * usdt:/usr/local/bin/vnc_server:fbvnc:update_end. Each is a single nop
+ * when nothing is attached. */
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define TRACE(name, ...)    STAP_PROBEV(fbvnc, name, ## __VA_ARGS__)
+#else
+#define TRACE(name, ...)    do { } while (0)
+#endif
+
 /*****************************************************************************/
 //#define LOG_FPS
 
@@ -69,23 +92,9 @@ static const char *PTR_PATTERNS[] = {
 
 int VERBOSITY = 1;
 
-static char fb_device[PATH_MAX] = "/dev/fb0";
-static char *kbd_device   = 0;
-static char *mouse_device = 0;
-static struct fb_var_screeninfo scrinfo;
-static int fbfd = -1;
-static int kbdfd = -1;
-static int mousefd = -1;
-static unsigned short int *fbmmap = MAP_FAILED;
-static unsigned short int *vncbuf;
-static unsigned short int *fbbuf;
-
-static int vnc_port = 5900;
-static rfbScreenInfoPtr server;
-static size_t bytespp;
-
-static int xmin, xmax;
-static int ymin, ymax;
+#define MAX_DISPLAYS        4
+#define DEFAULT_VNC_PORT    5900
+#define MAX_SHM_SUBSCRIBERS 8
 
 #define LOG1(fmt, ...) \
     if (VERBOSITY > 0) fprintf(stderr, fmt, ## __VA_ARGS__)
@@ -93,7 +102,7 @@ static int ymin, ymax;
 #define LOG2(fmt, ...) \
     if (VERBOSITY > 1) fprintf(stderr, fmt, ## __VA_ARGS__)
 
-static struct varblock_t
+struct varblock_t
 {
     int r_offset;
     int g_offset;
@@ -104,16 +113,94 @@ static struct varblock_t
     int max_y;
     int rfb_xres;
     int rfb_maxy;
-} varblock;
+};
 
-static struct button_mask
+struct shm_subscriber
+{
+    int sock;
+    int efd;
+};
+
+struct button_mask
 {
     int left;
     int middle;
     int right;
     int up;
     int down;
-} last_mouse_state;
+};
+
+/* Everything needed to serve one framebuffer device on its own VNC port,
+ * along with the input devices its clients control, if any. */
+struct fb_display
+{
+    char fb_device[PATH_MAX];
+    int vnc_port;
+
+    char *kbd_device;
+    char *mouse_device;
+    int kbdfd;
+    int mousefd;
+    int xmin, xmax;
+    int ymin, ymax;
+    struct button_mask last_mouse_state;
+
+    struct fb_var_screeninfo scrinfo;
+    int fbfd;
+    unsigned short int *fbmmap;
+    unsigned short int *vncbuf;
+    unsigned short int *fbbuf;
+    size_t bytespp;
+
+    rfbScreenInfoPtr server;
+    struct varblock_t varblock;
+
+    int row_words;          /* 32 bit words per framebuffer row */
+    int tiles_x;
+    int tiles_y;
+    unsigned char *tile_hit;
+    unsigned char *tile_recent;
+    int probe_phase;
+    unsigned int probe_frame;
+
+    uint64_t lat_input;     /* injection time of input awaiting a change */
+
+    char *shm_path;
+    int shm_fd;
+    int shm_listen;
+    struct fb_shm_header *shm;
+    struct shm_subscriber shm_subs[MAX_SHM_SUBSCRIBERS];
+    int num_shm_subs;
+};
+
+static struct fb_display displays[MAX_DISPLAYS];
+static int num_displays = 0;
+
+static char *record_file = 0;
+static char *replay_file = 0;
+static int replay_realtime = 0;
+static int replay_clients = 0;
+
+/* Probe scanning: instead of reading the whole framebuffer every frame,
+ * update_screen() reads every PROBE_INTERVAL-th row, at a phase that moves
+ * each frame, and a few sample words of every tile. Only the tiles where a
+ * probe found a difference, or that border recent damage, are compared in
+ * full. Every PROBE_SWEEP frames the whole framebuffer is compared anyway. */
+#define PROBE_TILE          32      /* pixels square, a multiple of 4 */
+#define PROBE_INTERVAL      8
+#define PROBE_PHASE_STEP    3       /* coprime with PROBE_INTERVAL */
+#define PROBE_TILE_SAMPLES  8
+#define PROBE_RECENT        4       /* frames a damaged tile stays "recent" */
+#define PROBE_SWEEP         64
+
+static int probe_scan = 1;
+
+/* How long update_screen() lets libvncserver work on an update it marked */
+static long flush_usec = 10000;
+
+static volatile sig_atomic_t running = 1;
+
+static int latency_stats = 0;
 
 /*****************************************************************************/
 
@@ -122,151 +209,685 @@ static void ptrevent(int buttonMask, int x, int y, rfbClientPtr cl);
 
 /*****************************************************************************/
 
-static void init_fb(void)
+static void init_fb(struct fb_display *d)
 {
     size_t pixels;
 
-    if ((fbfd = open(fb_device, O_RDONLY)) == -1)
+    if ((d->fbfd = open(d->fb_device, O_RDONLY)) == -1)
     {
-        LOG1("Error: Can not open framebuffer device \"%s\".\n", fb_device);
+        LOG1("Error: Can not open framebuffer device \"%s\".\n", d->fb_device);
         exit(EXIT_FAILURE);
     }
 
-    if (ioctl(fbfd, FBIOGET_VSCREENINFO, &scrinfo) != 0)
+    if (ioctl(d->fbfd, FBIOGET_VSCREENINFO, &d->scrinfo) != 0)
     {
         LOG1("Error: ioctl call failed.\n");
         exit(EXIT_FAILURE);
     }
 
-    pixels = scrinfo.xres * scrinfo.yres;
-    bytespp = scrinfo.bits_per_pixel / 8;
+    pixels = d->scrinfo.xres * d->scrinfo.yres;
+    d->bytespp = d->scrinfo.bits_per_pixel / 8;
+    d->row_words = (d->scrinfo.xres * d->bytespp + 3) / 4;
 
     LOG2("xres=%d, yres=%d, xresv=%d, yresv=%d, xoffs=%d, yoffs=%d, bpp=%d\n",
-            (int)scrinfo.xres, (int)scrinfo.yres,
-            (int)scrinfo.xres_virtual, (int)scrinfo.yres_virtual,
-            (int)scrinfo.xoffset, (int)scrinfo.yoffset,
-            (int)scrinfo.bits_per_pixel);
+            (int)d->scrinfo.xres, (int)d->scrinfo.yres,
+            (int)d->scrinfo.xres_virtual, (int)d->scrinfo.yres_virtual,
+            (int)d->scrinfo.xoffset, (int)d->scrinfo.yoffset,
+            (int)d->scrinfo.bits_per_pixel);
 
     LOG2("offset:length red=%d:%d green=%d:%d blue=%d:%d \n",
-            (int)scrinfo.red.offset, (int)scrinfo.red.length,
-            (int)scrinfo.green.offset, (int)scrinfo.green.length,
-            (int)scrinfo.blue.offset, (int)scrinfo.blue.length
+            (int)d->scrinfo.red.offset, (int)d->scrinfo.red.length,
+            (int)d->scrinfo.green.offset, (int)d->scrinfo.green.length,
+            (int)d->scrinfo.blue.offset, (int)d->scrinfo.blue.length
             );
 
-    fbmmap = mmap(NULL, pixels * bytespp, PROT_READ, MAP_SHARED, fbfd, 0);
+    d->fbmmap = mmap(NULL, pixels * d->bytespp, PROT_READ, MAP_SHARED, d->fbfd, 0);
 
-    if (fbmmap == MAP_FAILED)
+    if (d->fbmmap == MAP_FAILED)
     {
         LOG1("Error: failed to map framebuffer device to memory\n");
         exit(EXIT_FAILURE);
     }
 }
 
-static void cleanup_fb(void)
+static void cleanup_fb(struct fb_display *d)
 {
-    if(fbfd != -1)
+    if(d->fbfd != -1)
     {
-        close(fbfd);
+        close(d->fbfd);
     }
 }
 
-static void init_kbd()
+static void init_kbd(struct fb_display *d)
 {
-    if((kbdfd = open(kbd_device, O_RDWR)) == -1)
+    if((d->kbdfd = open(d->kbd_device, O_RDWR)) == -1)
     {
-        LOG1("cannot open kbd device %s\n", kbd_device);
+        LOG1("cannot open kbd device %s\n", d->kbd_device);
         exit(EXIT_FAILURE);
     }
 }
 
-static void cleanup_kbd()
+static void cleanup_kbd(struct fb_display *d)
 {
-    if(kbdfd != -1)
+    if(d->kbdfd != -1)
     {
-        close(kbdfd);
+        close(d->kbdfd);
     }
 }
 
-static void init_mouse()
+static void init_mouse(struct fb_display *d)
 {
     struct input_absinfo info;
 
-    if((mousefd = open(mouse_device, O_RDWR)) == -1)
+    if((d->mousefd = open(d->mouse_device, O_RDWR)) == -1)
     {
-        LOG1("Error: Can not open mouse device \"%s\".\n", mouse_device);
+        LOG1("Error: Can not open mouse device \"%s\".\n", d->mouse_device);
         exit(EXIT_FAILURE);
     }
 
     /* Get the range of X and Y */
-    if(ioctl(mousefd, EVIOCGABS(ABS_X), &info)) {
+    if(ioctl(d->mousefd, EVIOCGABS(ABS_X), &info)) {
         LOG1("Error: ioctl call failed - can not get ABS_X info on mouse device.\n%s\n", strerror(errno));
         exit(EXIT_FAILURE);
     }
-    xmin = info.minimum;
-    xmax = info.maximum;
+    d->xmin = info.minimum;
+    d->xmax = info.maximum;
 
-    if(ioctl(mousefd, EVIOCGABS(ABS_Y), &info)) {
+    if(ioctl(d->mousefd, EVIOCGABS(ABS_Y), &info)) {
         LOG1("Error: ioctl call failed - can not get ABS_Y info on mouse device.\n%s\n", strerror(errno));
         exit(EXIT_FAILURE);
     }
-    ymin = info.minimum;
-    ymax = info.maximum;
+    d->ymin = info.minimum;
+    d->ymax = info.maximum;
+
+    LOG2("xmin=%d, xmax=%d, ymin=%d, ymax=%d\n", (int) d->xmin, (int) d->xmax, (int) d->ymin, (int) d->ymax);
+}
+
+static void cleanup_mouse(struct fb_display *d)
+{
+    if(d->mousefd != -1)
+    {
+        close(d->mousefd);
+    }
+}
+
+/*****************************************************************************/
+
+/* Input-to-photon latency is split into stages: from an input event being
+ * accepted to it being injected, from injection to the next framebuffer
+ * change on the same display, from that change to libvncserver starting an
+ * update for a client (its deferUpdateTime plus the wait for the client to
+ * ask), and from there until the update has been encoded and written to the
+ * client's socket; libvncserver does both at once, so they are one stage. */
+
+enum lat_stage
+{
+    LAT_INJECT,
+    LAT_CHANGE,
+    LAT_QUEUE,
+    LAT_SEND,
+    LAT_STAGES
+};
+
+static const char *LAT_STAGE_NAMES[] = {
+    "inject",
+    "first-change",
+    "queue",
+    "encode+send",
+};
+
+/* Bucket n counts samples below 2^n microseconds; the last takes the rest */
+#define LAT_BUCKETS         24
+
+/* Inputs that have not caused a change after this long are forgotten */
+#define LAT_PROBE_TIMEOUT   1000000
+
+struct lat_histogram
+{
+    unsigned long count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    unsigned long buckets[LAT_BUCKETS];
+};
+
+struct client_latency
+{
+    uint64_t change;        /* when the change this client awaits was found */
+    uint64_t start;         /* when the update carrying it was started */
+};
+
+static struct lat_histogram lat_hist[LAT_STAGES];
+static uint64_t lat_reported;
+
+static uint64_t monotonic_usec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void lat_record(enum lat_stage stage, uint64_t usec)
+{
+    struct lat_histogram *h = &lat_hist[stage];
+    int bucket = 0;
+
+    while (bucket < LAT_BUCKETS - 1 && usec >= (1ULL << bucket))
+        bucket++;
+
+    if (h->count == 0 || usec < h->min)
+        h->min = usec;
+    if (usec > h->max)
+        h->max = usec;
+
+    h->count++;
+    h->sum += usec;
+    h->buckets[bucket]++;
+}
+
+/* Upper bound of the bucket holding the given fraction of the samples */
+static uint64_t lat_percentile(const struct lat_histogram *h, double fraction)
+{
+    unsigned long seen = 0, wanted = h->count * fraction;
+    int bucket;
+
+    for (bucket = 0; bucket < LAT_BUCKETS - 1; bucket++)
+    {
+        seen += h->buckets[bucket];
+        if (seen > wanted)
+            break;
+    }
+
+    if (bucket == LAT_BUCKETS - 1 || (1ULL << bucket) > h->max)
+        return h->max;
+
+    return 1ULL << bucket;
+}
+
+/* Called once an input event has been written to its device. */
+static void latency_input(struct fb_display *d, uint64_t accepted)
+{
+    uint64_t now = monotonic_usec();
+
+    lat_record(LAT_INJECT, now - accepted);
+
+    /* Measure from the earliest input the screen has not reacted to yet */
+    if (d->lat_input == 0 || now - d->lat_input > LAT_PROBE_TIMEOUT)
+        d->lat_input = now;
+}
+
+/* Called when update_screen() finds damage while an input is pending. */
+static void latency_change(struct fb_display *d)
+{
+    uint64_t now = monotonic_usec();
+    rfbClientIteratorPtr iter;
+    rfbClientPtr cl;
+
+    if (now - d->lat_input > LAT_PROBE_TIMEOUT)
+    {
+        d->lat_input = 0;
+        return;
+    }
+
+    lat_record(LAT_CHANGE, now - d->lat_input);
+    d->lat_input = 0;
+
+    iter = rfbGetClientIterator(d->server);
+    while ((cl = rfbClientIteratorNext(iter)) != NULL)
+    {
+        struct client_latency *lat = cl->clientData;
+
+        if (lat != NULL && lat->change == 0)
+            lat->change = now;
+    }
+    rfbReleaseClientIterator(iter);
+}
+
+static void latency_client_gone(rfbClientPtr cl)
+{
+    free(cl->clientData);
+    cl->clientData = NULL;
+}
+
+static enum rfbNewClientAction latency_new_client(rfbClientPtr cl)
+{
+    cl->clientData = calloc(1, sizeof(struct client_latency));
+    cl->clientGoneHook = latency_client_gone;
+
+    return RFB_CLIENT_ACCEPT;
+}
+
+static void latency_update_start(rfbClientPtr cl)
+{
+    struct client_latency *lat = cl->clientData;
+
+    if (lat != NULL && lat->change != 0 && lat->start == 0)
+    {
+        lat->start = monotonic_usec();
+        lat_record(LAT_QUEUE, lat->start - lat->change);
+    }
+}
+
+static void latency_update_done(rfbClientPtr cl, int result)
+{
+    struct client_latency *lat = cl->clientData;
+
+    if (lat != NULL && lat->start != 0)
+    {
+        lat_record(LAT_SEND, monotonic_usec() - lat->start);
+        lat->change = lat->start = 0;
+    }
+}
+
+/* Print and reset the histograms, at most once every LAT_REPORT seconds
+ * unless forced. */
+#define LAT_REPORT  5
+
+static void latency_report(int force)
+{
+    uint64_t now = monotonic_usec();
+    int stage, bucket;
+
+    if (!force && now - lat_reported < LAT_REPORT * 1000000ULL)
+        return;
+    lat_reported = now;
+
+    LOG1("latency (us)        count       min      mean       p50       p99       max\n");
+
+    for (stage = 0; stage < LAT_STAGES; stage++)
+    {
+        struct lat_histogram *h = &lat_hist[stage];
+
+        if (h->count == 0)
+        {
+            LOG1("  %-14s %8d\n", LAT_STAGE_NAMES[stage], 0);
+            continue;
+        }
+
+        LOG1("  %-14s %8lu %9llu %9llu %9llu %9llu %9llu\n",
+             LAT_STAGE_NAMES[stage], h->count,
+             (unsigned long long) h->min,
+             (unsigned long long) (h->sum / h->count),
+             (unsigned long long) lat_percentile(h, 0.5),
+             (unsigned long long) lat_percentile(h, 0.99),
+             (unsigned long long) h->max);
+
+        LOG2("   ");
+        for (bucket = 0; bucket < LAT_BUCKETS; bucket++)
+        {
+            if (h->buckets[bucket] == 0)
+                continue;
+
+            if (bucket < LAT_BUCKETS - 1)
+            {
+                LOG2(" <%llu:%lu", 1ULL << bucket, h->buckets[bucket]);
+            }
+            else
+            {
+                LOG2(" more:%lu", h->buckets[bucket]);
+            }
+        }
+        LOG2("\n");
+
+        memset(h, 0, sizeof(*h));
+    }
+}
+
+/*****************************************************************************/
+
+/* Publish the frame sent to VNC clients to local processes through shared
+ * memory; see fb-shm.h for the layout and protocol. The memfd itself holds
+ * the VNC frame buffer, so publishing costs no extra copy. */
+
+/* Linux 5.1, not yet in every libc's headers */
+#ifndef F_SEAL_FUTURE_WRITE
+#define F_SEAL_FUTURE_WRITE 0x0010
+#endif
+
+static size_t page_align(size_t size)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+
+    return (size + page - 1) & ~(page - 1);
+}
+
+static void init_shm(struct fb_display *d)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+    mode_t mask;
+    int ret;
+    /* update_screen() writes whole words, so rows are padded to one */
+    size_t stride = d->row_words * 4;
+    size_t offset = page_align(sizeof(struct fb_shm_header));
+    size_t size = page_align(offset + stride * d->scrinfo.yres);
+
+    d->shm_fd = memfd_create("framebuffer-vnc-server", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (d->shm_fd == -1 || ftruncate(d->shm_fd, size) != 0 ||
+        fcntl(d->shm_fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW) != 0)
+    {
+        LOG1("Error: Can not create shared memory, %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    d->shm = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, d->shm_fd, 0);
+    if (d->shm == MAP_FAILED)
+    {
+        LOG1("Error: failed to map shared memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* From here on only our own mapping may write, even if a subscriber
+     * reopens the memfd read-write */
+    if (fcntl(d->shm_fd, F_ADD_SEALS, F_SEAL_FUTURE_WRITE | F_SEAL_SEAL) != 0)
+    {
+        LOG1("Warning: kernel can not seal shared memory against writes, "
+             "subscribers can modify it.\n");
+        fcntl(d->shm_fd, F_ADD_SEALS, F_SEAL_SEAL);
+    }
+
+    d->shm->magic = FB_SHM_MAGIC;
+    d->shm->version = FB_SHM_VERSION;
+    d->shm->width = d->scrinfo.xres;
+    d->shm->height = d->scrinfo.yres;
+    d->shm->bytes_per_pixel = d->bytespp;
+    d->shm->stride = stride;
+    d->shm->frame_offset = offset;
+    d->shm->ring_size = FB_SHM_RING_SIZE;
+
+    d->vncbuf = (unsigned short int *)((char *)d->shm + offset);
+
+    if ((d->shm_listen = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0)) == -1)
+    {
+        LOG1("Error: Can not create socket, %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, d->shm_path, sizeof(addr.sun_path) - 1);
+
+    /* Replace a socket left over from an earlier run, but nothing else */
+    if (lstat(d->shm_path, &st) == 0)
+    {
+        if (!S_ISSOCK(st.st_mode))
+        {
+            LOG1("Error: \"%s\" exists and is not a socket.\n", d->shm_path);
+            exit(EXIT_FAILURE);
+        }
+        unlink(d->shm_path);
+    }
+
+    /* Only the user the server runs as may subscribe */
+    mask = umask(0177);
+    ret = bind(d->shm_listen, (struct sockaddr *)&addr, sizeof(addr));
+    umask(mask);
+
+    if (ret != 0 || listen(d->shm_listen, MAX_SHM_SUBSCRIBERS) != 0)
+    {
+        LOG1("Error: Can not listen on \"%s\", %s\n", d->shm_path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Record the pixel format libvncserver settled on for the frame. */
+static void shm_set_format(struct fb_display *d)
+{
+    rfbPixelFormat *format = &d->server->serverFormat;
+
+    d->shm->red_max = format->redMax;
+    d->shm->green_max = format->greenMax;
+    d->shm->blue_max = format->blueMax;
+    d->shm->red_shift = format->redShift;
+    d->shm->green_shift = format->greenShift;
+    d->shm->blue_shift = format->blueShift;
+}
+
+static void shm_unsubscribe(struct fb_display *d, int n)
+{
+    close(d->shm_subs[n].sock);
+    close(d->shm_subs[n].efd);
+    d->shm_subs[n] = d->shm_subs[--d->num_shm_subs];
+
+    LOG2("Shared memory subscriber left %s\n", d->shm_path);
+}
+
+/* Hand a new subscriber a read-only view of the memfd and its own eventfd. */
+static void shm_subscribe(struct fb_display *d, int sock)
+{
+    char path[64], byte = 0;
+    char control[CMSG_SPACE(2 * sizeof(int))];
+    struct iovec iov = { &byte, 1 };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    int fds[2];
+
+    if (d->num_shm_subs == MAX_SHM_SUBSCRIBERS)
+    {
+        LOG1("Too many shared memory subscribers on %s\n", d->shm_path);
+        close(sock);
+        return;
+    }
+
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", d->shm_fd);
+    fds[0] = open(path, O_RDONLY | O_CLOEXEC);
+    fds[1] = eventfd(0, EFD_CLOEXEC);
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    if (fds[0] == -1 || fds[1] == -1 || sendmsg(sock, &msg, MSG_NOSIGNAL) != 1)
+    {
+        LOG1("Failed to pass shared memory to subscriber, %s\n", strerror(errno));
+        if (fds[1] != -1)
+            close(fds[1]);
+        close(sock);
+    }
+    else
+    {
+        d->shm_subs[d->num_shm_subs].sock = sock;
+        d->shm_subs[d->num_shm_subs].efd = fds[1];
+        d->num_shm_subs++;
+
+        LOG2("Shared memory subscriber joined %s\n", d->shm_path);
+    }
+
+    if (fds[0] != -1)
+        close(fds[0]);
+}
+
+static void shm_add_fds(fd_set *fds, int *maxfd)
+{
+    int i, n;
+
+    for (i = 0; i < num_displays; i++)
+    {
+        struct fb_display *d = &displays[i];
+
+        if (d->shm == NULL)
+            continue;
+
+        FD_SET(d->shm_listen, fds);
+        if (d->shm_listen > *maxfd)
+            *maxfd = d->shm_listen;
+
+        for (n = 0; n < d->num_shm_subs; n++)
+        {
+            FD_SET(d->shm_subs[n].sock, fds);
+            if (d->shm_subs[n].sock > *maxfd)
+                *maxfd = d->shm_subs[n].sock;
+        }
+    }
+}
+
+static void shm_handle_fds(fd_set *fds)
+{
+    char buf[64];
+    int i, n, sock;
+
+    for (i = 0; i < num_displays; i++)
+    {
+        struct fb_display *d = &displays[i];
+
+        if (d->shm == NULL)
+            continue;
+
+        /* Subscribers are not expected to talk; readable means gone */
+        for (n = d->num_shm_subs - 1; n >= 0; n--)
+        {
+            if (FD_ISSET(d->shm_subs[n].sock, fds) &&
+                recv(d->shm_subs[n].sock, buf, sizeof(buf), MSG_DONTWAIT) <= 0)
+            {
+                shm_unsubscribe(d, n);
+            }
+        }
+
+        if (FD_ISSET(d->shm_listen, fds) &&
+            (sock = accept4(d->shm_listen, NULL, NULL, SOCK_CLOEXEC)) != -1)
+        {
+            shm_subscribe(d, sock);
+        }
+    }
+}
 
-    LOG2("xmin=%d, xmax=%d, ymin=%d, ymax=%d\n", (int) xmin, (int) xmax, (int) ymin, (int) ymax);
+/* Called before update_screen() first writes to the frame. */
+static void shm_begin(struct fb_display *d)
+{
+    __atomic_store_n(&d->shm->seq, d->shm->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
 }
 
-static void cleanup_mouse()
+/* Called once update_screen() is done with the frame; x2/y2 are exclusive. */
+static void shm_publish(struct fb_display *d, int x1, int y1, int x2, int y2)
 {
-    if(mousefd != -1)
+    struct fb_shm_header *shm = d->shm;
+    struct fb_shm_rect *rect = &shm->ring[shm->ring_head % FB_SHM_RING_SIZE];
+    uint64_t one = 1;
+    int n;
+
+    rect->frame = (shm->seq + 1) / 2;
+    rect->x = x1;
+    rect->y = y1;
+    rect->w = x2 - x1;
+    rect->h = y2 - y1;
+    shm->ring_head++;
+
+    __atomic_store_n(&shm->seq, shm->seq + 1, __ATOMIC_RELEASE);
+
+    for (n = 0; n < d->num_shm_subs; n++)
     {
-        close(mousefd);
+        if (write(d->shm_subs[n].efd, &one, sizeof(one)) < 0)
+        {
+            LOG1("write event failed, %s\n", strerror(errno));
+        }
     }
 }
 
+static void cleanup_shm(struct fb_display *d)
+{
+    if (d->shm == NULL)
+        return;
+
+    while (d->num_shm_subs > 0)
+        shm_unsubscribe(d, d->num_shm_subs - 1);
+
+    close(d->shm_listen);
+    unlink(d->shm_path);
+    close(d->shm_fd);
+}
+
 /*****************************************************************************/
 
-static void init_fb_server(int argc, char **argv)
+static void init_fb_server(struct fb_display *d, int argc, char **argv)
 {
+    struct fb_var_screeninfo *scrinfo = &d->scrinfo;
+    char **args;
+
     LOG2("Initializing server...\n");
 
     /* Allocate the VNC server buffer to be managed (not manipulated) by
-     * libvncserver. */
-    vncbuf = calloc(scrinfo.xres * scrinfo.yres, bytespp + 1);
-    assert(vncbuf != NULL);
+     * libvncserver. When exporting frames it lives in shared memory. */
+    if (d->shm_path)
+    {
+        init_shm(d);
+    }
+    else
+    {
+        d->vncbuf = calloc(scrinfo->xres * scrinfo->yres, d->bytespp + 1);
+        assert(d->vncbuf != NULL);
+    }
 
     /* Allocate the comparison buffer for detecting drawing updates from frame
      * to frame. */
-    fbbuf = calloc(scrinfo.xres * scrinfo.yres, bytespp + 1);
-    assert(fbbuf != NULL);
-
-    server = rfbGetScreen(&argc, argv, scrinfo.xres, scrinfo.yres, BITS_PER_SAMPLE, SAMPLES_PER_PIXEL, bytespp);
-    assert(server != NULL);
-
-    server->desktopName = "framebuffer";
-    server->frameBuffer = (char *)vncbuf;
-    server->alwaysShared = TRUE;
-    server->httpDir = NULL;
-    server->port = vnc_port;
+    d->fbbuf = calloc(scrinfo->xres * scrinfo->yres, d->bytespp + 1);
+    assert(d->fbbuf != NULL);
+
+    /* libvncserver removes the options it handles (-rfbauth, -passwd, ...)
+     * from argv as it parses them. Hand it a copy of the array, so that they
+     * are still there for the next display. */
+    args = calloc(argc + 1, sizeof(char *));
+    assert(args != NULL);
+    memcpy(args, argv, argc * sizeof(char *));
+
+    d->server = rfbGetScreen(&argc, args, scrinfo->xres, scrinfo->yres, BITS_PER_SAMPLE, SAMPLES_PER_PIXEL, d->bytespp);
+    assert(d->server != NULL);
+    free(args);
+
+    d->server->desktopName = "framebuffer";
+    d->server->frameBuffer = (char *)d->vncbuf;
+    d->server->paddedWidthInBytes = d->row_words * 4;
+    d->server->alwaysShared = TRUE;
+    d->server->httpDir = NULL;
+    d->server->port = d->vnc_port;
+    d->server->screenData = d;
+
+    d->server->kbdAddEvent = keyevent;
+    d->server->ptrAddEvent = ptrevent;
+
+    if (latency_stats)
+    {
+        d->server->newClientHook = latency_new_client;
+        d->server->displayHook = latency_update_start;
+        d->server->displayFinishedHook = latency_update_done;
+    }
 
-    server->kbdAddEvent = keyevent;
-    server->ptrAddEvent = ptrevent;
+    if (d->shm)
+        shm_set_format(d);
 
-    rfbInitServer(server);
+    rfbInitServer(d->server);
 
     /* Mark as dirty since we haven't sent any updates at all yet. */
-    rfbMarkRectAsModified(server, 0, 0, scrinfo.xres, scrinfo.yres);
+    TRACE(mark_rect, (int)(d - displays), 0, 0, scrinfo->xres, scrinfo->yres);
+    rfbMarkRectAsModified(d->server, 0, 0, scrinfo->xres, scrinfo->yres);
+
+    /* Set up the tiles used for probe scanning */
+    d->tiles_x = (scrinfo->xres + PROBE_TILE - 1) / PROBE_TILE;
+    d->tiles_y = (scrinfo->yres + PROBE_TILE - 1) / PROBE_TILE;
+    d->tile_hit = calloc(d->tiles_x * d->tiles_y, 1);
+    d->tile_recent = calloc(d->tiles_x * d->tiles_y, 1);
+    assert(d->tile_hit != NULL && d->tile_recent != NULL);
 
     /* Specify the bit offset of each colour in a pixel */
-    varblock.r_offset = scrinfo.red.offset + scrinfo.red.length - BITS_PER_SAMPLE;
-    varblock.g_offset = scrinfo.green.offset + scrinfo.green.length - BITS_PER_SAMPLE;
-    varblock.b_offset = scrinfo.blue.offset + scrinfo.blue.length - BITS_PER_SAMPLE;
-    varblock.rfb_xres = scrinfo.yres;
-    varblock.rfb_maxy = scrinfo.xres - 1;
+    d->varblock.r_offset = scrinfo->red.offset + scrinfo->red.length - BITS_PER_SAMPLE;
+    d->varblock.g_offset = scrinfo->green.offset + scrinfo->green.length - BITS_PER_SAMPLE;
+    d->varblock.b_offset = scrinfo->blue.offset + scrinfo->blue.length - BITS_PER_SAMPLE;
+    d->varblock.rfb_xres = scrinfo->yres;
+    d->varblock.rfb_maxy = scrinfo->xres - 1;
 }
 
 /*****************************************************************************/
 
-void injectKeyEvent(uint16_t code, uint16_t value)
+void injectKeyEvent(struct fb_display *d, uint16_t code, uint16_t value)
 {
     struct input_event ev;
 
@@ -277,7 +898,7 @@ void injectKeyEvent(uint16_t code, uint16_t value)
     ev.type  = EV_KEY;
     ev.code  = code;
     ev.value = value;
-    if(write(kbdfd, &ev, sizeof(ev)) < 0)
+    if(write(d->kbdfd, &ev, sizeof(ev)) < 0)
     {
         LOG1("write event failed, %s\n", strerror(errno));
     }
@@ -287,11 +908,12 @@ void injectKeyEvent(uint16_t code, uint16_t value)
     ev.type  = EV_SYN;
     ev.code  = 0;
     ev.value = 0;
-    if(write(kbdfd, &ev, sizeof(ev)) < 0)
+    if(write(d->kbdfd, &ev, sizeof(ev)) < 0)
     {
         LOG1("write event failed, %s\n", strerror(errno));
     }
 
+    TRACE(key_inject, code, value);
     LOG2("injectKey (%d, %d)\n", code, value);
 }
 
@@ -379,13 +1001,22 @@ static int keysym2scancode(rfbBool down, rfbKeySym key, rfbClientPtr cl)
 
 static void keyevent(rfbBool down, rfbKeySym key, rfbClientPtr cl)
 {
+    uint64_t accepted = latency_stats ? monotonic_usec() : 0;
+    struct fb_display *d = (struct fb_display *) cl->screen->screenData;
     int scancode;
 
     LOG2("Got keysym: %04x (down=%d)\n", (unsigned int) key, (int) down);
 
+    /* No keyboard for this display, or replaying a recording */
+    if (d->kbdfd == -1)
+        return;
+
     if ((scancode = keysym2scancode(down, key, cl)))
     {
-         injectKeyEvent(scancode, down);
+         injectKeyEvent(d, scancode, down);
+
+         if (latency_stats)
+             latency_input(d, accepted);
     }
 }
 
@@ -405,14 +1036,21 @@ struct button_mask *BtnMsk2Struct(int buttonMask)
 
 static void ptrevent(int buttonMask, int x, int y, rfbClientPtr cl)
 {
+    uint64_t accepted = latency_stats ? monotonic_usec() : 0;
+    struct fb_display *d = (struct fb_display *) cl->screen->screenData;
+
     LOG2("Got ptrevent: %04x (x=%d, y=%d)\n", buttonMask, x, y);
 
+    /* No mouse for this display, or replaying a recording */
+    if (d->mousefd == -1)
+        return;
+
     struct input_event  ev;
     struct button_mask *mask = BtnMsk2Struct(buttonMask);
 
     /* Calculate the final x and y */
-    x = xmin + (x * (xmax - xmin)) / (scrinfo.xres);
-    y = ymin + (y * (ymax - ymin)) / (scrinfo.yres);
+    x = d->xmin + (x * (d->xmax - d->xmin)) / (d->scrinfo.xres);
+    y = d->ymin + (y * (d->ymax - d->ymin)) / (d->scrinfo.yres);
 
     memset(&ev, 0, sizeof(ev));
 
@@ -421,7 +1059,7 @@ static void ptrevent(int buttonMask, int x, int y, rfbClientPtr cl)
     ev.type  = EV_KEY;
     ev.code  = BTN_TOUCH;
     ev.value = mask->down;
-    if(write(mousefd, &ev, sizeof(ev)) < 0)
+    if(write(d->mousefd, &ev, sizeof(ev)) < 0)
     {
         LOG1("write event failed, %s\n", strerror(errno));
     }
@@ -431,7 +1069,7 @@ static void ptrevent(int buttonMask, int x, int y, rfbClientPtr cl)
     ev.type  = EV_ABS;
     ev.code  = ABS_X;
     ev.value = x;
-    if(write(mousefd, &ev, sizeof(ev)) < 0)
+    if(write(d->mousefd, &ev, sizeof(ev)) < 0)
     {
         LOG1("write event failed, %s\n", strerror(errno));
     }
@@ -441,71 +1079,71 @@ static void ptrevent(int buttonMask, int x, int y, rfbClientPtr cl)
     ev.type  = EV_ABS;
     ev.code  = ABS_Y;
     ev.value = y;
-    if(write(mousefd, &ev, sizeof(ev)) < 0)
+    if(write(d->mousefd, &ev, sizeof(ev)) < 0)
     {
         LOG1("write event failed, %s\n", strerror(errno));
     }
 
-    if (last_mouse_state.left != mask->left) {
-        last_mouse_state.left  = mask->left;
+    if (d->last_mouse_state.left != mask->left) {
+        d->last_mouse_state.left  = mask->left;
 
         gettimeofday(&ev.time, 0);
         ev.type  = EV_KEY;
         ev.code  = BTN_LEFT;
         ev.value = mask->left;
-        if(write(mousefd, &ev, sizeof(ev)) < 0)
+        if(write(d->mousefd, &ev, sizeof(ev)) < 0)
         {
             LOG1("write event failed, %s\n", strerror(errno));
         }
     }
 
-    if (last_mouse_state.middle != mask->middle) {
-        last_mouse_state.middle  = mask->middle;
+    if (d->last_mouse_state.middle != mask->middle) {
+        d->last_mouse_state.middle  = mask->middle;
 
         gettimeofday(&ev.time, 0);
         ev.type  = EV_KEY;
         ev.code  = BTN_MIDDLE;
         ev.value = mask->middle;
-        if(write(mousefd, &ev, sizeof(ev)) < 0)
+        if(write(d->mousefd, &ev, sizeof(ev)) < 0)
         {
             LOG1("write event failed, %s\n", strerror(errno));
         }
     }
 
-    if (last_mouse_state.right != mask->right) {
-        last_mouse_state.right  = mask->right;
+    if (d->last_mouse_state.right != mask->right) {
+        d->last_mouse_state.right  = mask->right;
 
         gettimeofday(&ev.time, 0);
         ev.type  = EV_KEY;
         ev.code  = BTN_RIGHT;
         ev.value = mask->right;
-        if(write(mousefd, &ev, sizeof(ev)) < 0)
+        if(write(d->mousefd, &ev, sizeof(ev)) < 0)
         {
             LOG1("write event failed, %s\n", strerror(errno));
         }
     }
 
-    if (last_mouse_state.up != mask->up) {
-        last_mouse_state.up  = mask->up;
+    if (d->last_mouse_state.up != mask->up) {
+        d->last_mouse_state.up  = mask->up;
 
         gettimeofday(&ev.time, 0);
         ev.type  = EV_REL;
         ev.code  = REL_WHEEL;
         ev.value = mask->up;
-        if(write(mousefd, &ev, sizeof(ev)) < 0)
+        if(write(d->mousefd, &ev, sizeof(ev)) < 0)
         {
             LOG1("write event failed, %s\n", strerror(errno));
         }
     }
 
-    if (last_mouse_state.down != mask->down) {
-        last_mouse_state.down  = mask->down;
+    if (d->last_mouse_state.down != mask->down) {
+        d->last_mouse_state.down  = mask->down;
 
         gettimeofday(&ev.time, 0);
         ev.type  = EV_REL;
         ev.code  = REL_WHEEL;
         ev.value = -mask->down;
-        if(write(mousefd, &ev, sizeof(ev)) < 0)
+        if(write(d->mousefd, &ev, sizeof(ev)) < 0)
         {
             LOG1("write event failed, %s\n", strerror(errno));
         }
@@ -516,34 +1154,560 @@ static void ptrevent(int buttonMask, int x, int y, rfbClientPtr cl)
     ev.type  = EV_SYN;
     ev.code  = 0;
     ev.value = 0;
-    if(write(mousefd, &ev, sizeof(ev)) < 0)
+    if(write(d->mousefd, &ev, sizeof(ev)) < 0)
     {
         LOG1("write event failed, %s\n", strerror(errno));
     }
+
+    TRACE(ptr_inject, (int)(d - displays), buttonMask, x, y);
+
+    if (latency_stats)
+        latency_input(d, accepted);
 }
 
 /*****************************************************************************/
 
-#define LOG_TIME    5
+/* A recording is a gzip stream holding, in native byte order, one
+ * rec_file_header, one rec_display per display, and then one rec_frame per
+ * damaged rectangle found by update_screen(). Each rec_frame is followed by
+ * its w * h pixels, row by row, in the framebuffer's own pixel format. */
 
-int timeToLogFPS() {
-    static struct timeval now={0,0}, then={0,0};
-    double elapsed, dnow, dthen;
-    gettimeofday(&now,NULL);
-    dnow  = now.tv_sec  + (now.tv_usec /1000000.0);
-    dthen = then.tv_sec + (then.tv_usec/1000000.0);
-    elapsed = dnow - dthen;
-    if (elapsed > LOG_TIME)
-      memcpy((char *)&then, (char *)&now, sizeof(struct timeval));
-    return elapsed > LOG_TIME;
-}
+#define REC_MAGIC       "FBRC"
+#define REC_VERSION     1
 
-#define PIXEL_FB_TO_RFB(p,r,g,b) \
-    ((p>>r) & COLOR_MASK) | \
-   (((p>>g) & COLOR_MASK) << BITS_PER_SAMPLE) | \
-   (((p>>b) & COLOR_MASK) << (2 * BITS_PER_SAMPLE))
+/* Frames queued beyond this are dropped rather than stalling the capture */
+#define REC_QUEUE_MAX   (64 * 1024 * 1024)
 
-static void update_screen(void)
+/* Largest width or height accepted when replaying */
+#define REC_MAX_RES     8192
+
+/* How long to keep sending once the replay is over */
+#define REPLAY_DRAIN_USEC   2000000
+
+struct rec_file_header
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t num_displays;
+};
+
+struct rec_display
+{
+    uint32_t xres;
+    uint32_t yres;
+    uint32_t bits_per_pixel;
+    uint32_t red_offset;
+    uint32_t red_length;
+    uint32_t green_offset;
+    uint32_t green_length;
+    uint32_t blue_offset;
+    uint32_t blue_length;
+};
+
+struct rec_frame
+{
+    uint64_t timestamp;     /* microseconds since the recording started */
+    uint32_t display;
+    uint32_t x, y, w, h;
+    uint32_t reserved;      /* zero; keeps the layout free of padding */
+};
+
+struct rec_buffer
+{
+    struct rec_buffer *next;
+    struct rec_frame frame;
+    size_t size;
+    unsigned char data[];
+};
+
+static struct recorder_t
+{
+    gzFile gz;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct rec_buffer *head;
+    struct rec_buffer *tail;
+    size_t queued;
+    int done;
+    int resync[MAX_DISPLAYS];   /* record the whole screen after a drop */
+    unsigned long frames;
+    unsigned long dropped;
+    uint64_t start;
+} recorder = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+static gzFile replay_gz;
+
+/* Drains the queue into the recording file, so that compression and disk
+ * writes never hold up the capture loop. */
+static void *recorder_thread(void *arg)
+{
+    struct rec_buffer *buf;
+    int err;
+
+    pthread_mutex_lock(&recorder.lock);
+    while (1)
+    {
+        while (recorder.head == NULL && !recorder.done)
+            pthread_cond_wait(&recorder.cond, &recorder.lock);
+
+        /* Only stop once everything queued has been written */
+        if ((buf = recorder.head) == NULL)
+            break;
+
+        recorder.head = buf->next;
+        if (recorder.head == NULL)
+            recorder.tail = NULL;
+        recorder.queued -= buf->size;
+        pthread_mutex_unlock(&recorder.lock);
+
+        if (gzwrite(recorder.gz, &buf->frame, sizeof(buf->frame)) != sizeof(buf->frame) ||
+            gzwrite(recorder.gz, buf->data, buf->size) != (int)buf->size)
+        {
+            LOG1("Error: failed to write recording, %s\n", gzerror(recorder.gz, &err));
+        }
+        free(buf);
+
+        pthread_mutex_lock(&recorder.lock);
+    }
+    pthread_mutex_unlock(&recorder.lock);
+
+    return NULL;
+}
+
+static void init_recorder(void)
+{
+    struct rec_file_header hdr;
+    struct rec_display rd;
+    int i;
+
+    /* Favour speed; framebuffer contents compress well even at level 1 */
+    if ((recorder.gz = gzopen(record_file, "wb1")) == NULL)
+    {
+        LOG1("Error: Can not open recording file \"%s\".\n", record_file);
+        exit(EXIT_FAILURE);
+    }
+
+    memcpy(hdr.magic, REC_MAGIC, sizeof(hdr.magic));
+    hdr.version = REC_VERSION;
+    hdr.num_displays = num_displays;
+    if (gzwrite(recorder.gz, &hdr, sizeof(hdr)) != sizeof(hdr))
+    {
+        LOG1("Error: Can not write recording file \"%s\".\n", record_file);
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < num_displays; i++)
+    {
+        struct fb_var_screeninfo *scrinfo = &displays[i].scrinfo;
+
+        rd.xres = scrinfo->xres;
+        rd.yres = scrinfo->yres;
+        rd.bits_per_pixel = scrinfo->bits_per_pixel;
+        rd.red_offset = scrinfo->red.offset;
+        rd.red_length = scrinfo->red.length;
+        rd.green_offset = scrinfo->green.offset;
+        rd.green_length = scrinfo->green.length;
+        rd.blue_offset = scrinfo->blue.offset;
+        rd.blue_length = scrinfo->blue.length;
+        if (gzwrite(recorder.gz, &rd, sizeof(rd)) != sizeof(rd))
+        {
+            LOG1("Error: Can not write recording file \"%s\".\n", record_file);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    recorder.start = monotonic_usec();
+
+    if (pthread_create(&recorder.thread, NULL, recorder_thread, NULL) != 0)
+    {
+        LOG1("Error: Can not start recording thread.\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void cleanup_recorder(void)
+{
+    if (recorder.gz == NULL)
+        return;
+
+    pthread_mutex_lock(&recorder.lock);
+    recorder.done = 1;
+    pthread_cond_signal(&recorder.cond);
+    pthread_mutex_unlock(&recorder.lock);
+
+    pthread_join(recorder.thread, NULL);
+    gzclose(recorder.gz);
+
+    LOG2("Recorded %lu frames, dropped %lu\n", recorder.frames, recorder.dropped);
+}
+
+/* Queue the pixels of a damaged rectangle (x2/y2 exclusive) for the writer.
+ * They are taken from the compare buffer, which update_screen() has just
+ * brought up to date, rather than from the framebuffer itself. */
+static void record_damage(struct fb_display *d, int x1, int y1, int x2, int y2)
+{
+    int n = d - displays;
+    size_t stride = d->row_words * 4;
+    size_t row, size;
+    struct rec_buffer *buf;
+    int full, y;
+
+    if (recorder.resync[n])
+    {
+        x1 = 0;
+        y1 = 0;
+        x2 = d->scrinfo.xres;
+        y2 = d->scrinfo.yres;
+    }
+
+    row = (x2 - x1) * d->bytespp;
+    size = row * (y2 - y1);
+
+    pthread_mutex_lock(&recorder.lock);
+    full = recorder.queued + size > REC_QUEUE_MAX;
+    pthread_mutex_unlock(&recorder.lock);
+
+    if (full || (buf = malloc(sizeof(*buf) + size)) == NULL)
+    {
+        /* Replay would miss this damage, so resend the screen next time */
+        recorder.dropped++;
+        recorder.resync[n] = 1;
+        return;
+    }
+    recorder.resync[n] = 0;
+
+    buf->next = NULL;
+    buf->size = size;
+    buf->frame.timestamp = monotonic_usec() - recorder.start;
+    buf->frame.display = n;
+    buf->frame.x = x1;
+    buf->frame.y = y1;
+    buf->frame.w = x2 - x1;
+    buf->frame.h = y2 - y1;
+    buf->frame.reserved = 0;
+
+    for (y = y1; y < y2; y++)
+    {
+        memcpy(buf->data + (y - y1) * row,
+               (unsigned char *)d->fbbuf + y * stride + x1 * d->bytespp, row);
+    }
+
+    pthread_mutex_lock(&recorder.lock);
+    if (recorder.tail != NULL)
+        recorder.tail->next = buf;
+    else
+        recorder.head = buf;
+    recorder.tail = buf;
+    recorder.queued += size;
+    recorder.frames++;
+    pthread_cond_signal(&recorder.cond);
+    pthread_mutex_unlock(&recorder.lock);
+}
+
+/* Set the displays up from a recording in place of framebuffer devices. The
+ * recorded pixels are written into a plain memory buffer which update_screen()
+ * then scans as if it was the mapped framebuffer. */
+static void init_replay(void)
+{
+    struct rec_file_header hdr;
+    struct rec_display rd;
+    int i;
+
+    if ((replay_gz = gzopen(replay_file, "rb")) == NULL)
+    {
+        LOG1("Error: Can not open recording file \"%s\".\n", replay_file);
+        exit(EXIT_FAILURE);
+    }
+
+    if (gzread(replay_gz, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+        memcmp(hdr.magic, REC_MAGIC, sizeof(hdr.magic)) != 0 ||
+        hdr.version != REC_VERSION ||
+        hdr.num_displays == 0 || hdr.num_displays > MAX_DISPLAYS)
+    {
+        LOG1("Error: \"%s\" is not a usable recording.\n", replay_file);
+        exit(EXIT_FAILURE);
+    }
+
+    num_displays = hdr.num_displays;
+
+    for (i = 0; i < num_displays; i++)
+    {
+        struct fb_display *d = &displays[i];
+
+        if (gzread(replay_gz, &rd, sizeof(rd)) != sizeof(rd) ||
+            (rd.bits_per_pixel != 8 && rd.bits_per_pixel != 16 &&
+             rd.bits_per_pixel != 32) ||
+            rd.xres == 0 || rd.xres > REC_MAX_RES ||
+            rd.yres == 0 || rd.yres > REC_MAX_RES ||
+            rd.red_offset + rd.red_length > rd.bits_per_pixel ||
+            rd.green_offset + rd.green_length > rd.bits_per_pixel ||
+            rd.blue_offset + rd.blue_length > rd.bits_per_pixel)
+        {
+            LOG1("Error: \"%s\" is not a usable recording.\n", replay_file);
+            exit(EXIT_FAILURE);
+        }
+
+        snprintf(d->fb_device, PATH_MAX, "%s:%d", replay_file, i);
+
+        memset(&d->scrinfo, 0, sizeof(d->scrinfo));
+        d->scrinfo.xres = d->scrinfo.xres_virtual = rd.xres;
+        d->scrinfo.yres = d->scrinfo.yres_virtual = rd.yres;
+        d->scrinfo.bits_per_pixel = rd.bits_per_pixel;
+        d->scrinfo.red.offset = rd.red_offset;
+        d->scrinfo.red.length = rd.red_length;
+        d->scrinfo.green.offset = rd.green_offset;
+        d->scrinfo.green.length = rd.green_length;
+        d->scrinfo.blue.offset = rd.blue_offset;
+        d->scrinfo.blue.length = rd.blue_length;
+        d->bytespp = rd.bits_per_pixel / 8;
+        d->row_words = (rd.xres * d->bytespp + 3) / 4;
+
+        /* Rows are as far apart as update_screen() expects, padded to a
+         * whole word */
+        d->fbmmap = calloc(d->row_words * rd.yres, 4);
+        assert(d->fbmmap != NULL);
+    }
+
+    /* As fast as possible means not idling once an update is marked */
+    if (!replay_realtime)
+        flush_usec = 0;
+}
+
+static void cleanup_replay(void)
+{
+    if (replay_gz != NULL)
+        gzclose(replay_gz);
+}
+
+/*****************************************************************************/
+
+#define LOG_TIME    5
+
+int timeToLogFPS() {
+    static struct timeval now={0,0}, then={0,0};
+    double elapsed, dnow, dthen;
+    gettimeofday(&now,NULL);
+    dnow  = now.tv_sec  + (now.tv_usec /1000000.0);
+    dthen = then.tv_sec + (then.tv_usec/1000000.0);
+    elapsed = dnow - dthen;
+    if (elapsed > LOG_TIME)
+      memcpy((char *)&then, (char *)&now, sizeof(struct timeval));
+    return elapsed > LOG_TIME;
+}
+
+#define PIXEL_FB_TO_RFB(p,r,g,b) \
+    ((p>>r) & COLOR_MASK) | \
+   (((p>>g) & COLOR_MASK) << BITS_PER_SAMPLE) | \
+   (((p>>b) & COLOR_MASK) << (2 * BITS_PER_SAMPLE))
+
+/* Compare words [w1, w2) of row y with the compare buffer, bringing it and
+ * the remote framebuffer up to date. Returns how many pixels changed. */
+static inline int compare_span(struct fb_display *d, int y, int w1, int w2)
+{
+    int xstep = 4/d->bytespp;
+    uint32_t pixel_mask = 0xffffffff >> (32 - 8 * d->bytespp);
+    int w, n, changed = 0;
+
+    uint32_t *f, *c, *r;
+
+    f = (uint32_t *)d->fbmmap + y * d->row_words + w1;     /* -> framebuffer         */
+    c = (uint32_t *)d->fbbuf + y * d->row_words + w1;      /* -> compare framebuffer */
+    r = (uint32_t *)d->vncbuf + y * d->row_words + w1;     /* -> remote framebuffer  */
+
+    /* Compare every 1/2/4 pixels at a time */
+    for (w = w1; w < w2; w++)
+    {
+        uint32_t pixel = *f;
+
+        if (pixel != *c)
+        {
+            uint32_t diff = pixel ^ *c;
+            int x = w * xstep;
+
+            /* Only the pixels of the word that differ count */
+            for (n = 0; n < xstep; n++)
+                changed += ((diff >> (n * 8 * d->bytespp)) & pixel_mask) != 0;
+
+            *c = pixel;
+
+            if (d->shm && !(d->shm->seq & 1))
+                shm_begin(d);
+
+            /* Translate the pixel for the remote framebuffer */
+            *r = PIXEL_FB_TO_RFB(pixel,
+                     d->varblock.r_offset,
+                     d->varblock.g_offset,
+                     d->varblock.b_offset);
+
+            if (x < d->varblock.min_x)
+                d->varblock.min_x = x;
+            if (x > d->varblock.max_x)
+                d->varblock.max_x = x;
+
+            if (y < d->varblock.min_y)
+                d->varblock.min_y = y;
+            if (y > d->varblock.max_y)
+                d->varblock.max_y = y;
+        }
+
+        f++;
+        c++;
+        r++;
+    }
+
+    return changed;
+}
+
+/* Compare every tile flagged in tile_hit, or all of them, row by row so the
+ * framebuffer is still read in order. Damaged tiles are marked recent.
+ * Returns how many pixels changed. */
+static int compare_tiles(struct fb_display *d, int all)
+{
+    int tile_words = PROBE_TILE * d->bytespp / 4;
+    int tx, ty, y, y2, w2, n, changed = 0;
+
+    for (ty = 0; ty < d->tiles_y; ty++)
+    {
+        unsigned char *hit = d->tile_hit + ty * d->tiles_x;
+        unsigned char *recent = d->tile_recent + ty * d->tiles_x;
+
+        y2 = (ty + 1) * PROBE_TILE;
+        if (y2 > (int)d->scrinfo.yres)
+            y2 = d->scrinfo.yres;
+
+        for (y = ty * PROBE_TILE; y < y2; y++)
+        {
+            for (tx = 0; tx < d->tiles_x; tx++)
+            {
+                if (!all && !hit[tx])
+                    continue;
+
+                w2 = (tx + 1) * tile_words;
+                if (w2 > d->row_words)
+                    w2 = d->row_words;
+
+                if ((n = compare_span(d, y, tx * tile_words, w2)))
+                {
+                    recent[tx] = PROBE_RECENT;
+                    changed += n;
+                }
+            }
+        }
+    }
+
+    return changed;
+}
+
+/* Flag in tile_hit the tiles which need a full compare this frame, on top
+ * of any already flagged by flag_tiles(). */
+static void probe_tiles(struct fb_display *d)
+{
+    int tile_words = PROBE_TILE * d->bytespp / 4;
+    int phase = d->probe_phase;
+    int tx, ty, x, y, w, w2, h, k, i, n;
+
+    uint32_t *f = (uint32_t *)d->fbmmap;
+    uint32_t *c = (uint32_t *)d->fbbuf;
+
+    /* Every PROBE_INTERVAL-th row, starting at this frame's phase */
+    for (y = phase; y < (int)d->scrinfo.yres; y += PROBE_INTERVAL)
+    {
+        unsigned char *hit = d->tile_hit + (y / PROBE_TILE) * d->tiles_x;
+        int row = y * d->row_words;
+
+        for (tx = 0; tx < d->tiles_x; tx++)
+        {
+            w2 = (tx + 1) * tile_words;
+            if (w2 > d->row_words)
+                w2 = d->row_words;
+
+            for (w = tx * tile_words; w < w2 && !hit[tx]; w++)
+                hit[tx] = f[row + w] != c[row + w];
+        }
+    }
+
+    /* A few words per tile on a pattern that also moves with the phase.
+     * Tiles start on a multiple of PROBE_INTERVAL, and the sample rows are
+     * 4 apart starting at an offset of phase + 2 (mod 4), so none of them
+     * falls on a row the row probe has just read. */
+    for (ty = 0; ty < d->tiles_y; ty++)
+    {
+        h = d->scrinfo.yres - ty * PROBE_TILE;
+        if (h > PROBE_TILE)
+            h = PROBE_TILE;
+
+        for (tx = 0; tx < d->tiles_x; tx++)
+        {
+            i = ty * d->tiles_x + tx;
+
+            w2 = d->row_words - tx * tile_words;
+            if (w2 > tile_words)
+                w2 = tile_words;
+
+            for (k = 0; k < PROBE_TILE_SAMPLES && !d->tile_hit[i]; k++)
+            {
+                y = k * PROBE_TILE / PROBE_TILE_SAMPLES + (phase + 2) % 4;
+                if (y >= h)
+                    break;
+
+                y += ty * PROBE_TILE;
+                w = tx * tile_words +
+                    (k * tile_words / PROBE_TILE_SAMPLES + phase * PROBE_PHASE_STEP) % w2;
+
+                d->tile_hit[i] = f[y * d->row_words + w] != c[y * d->row_words + w];
+            }
+        }
+    }
+
+    /* Damage tends to continue where it was, and spread to its neighbours */
+    for (ty = 0; ty < d->tiles_y; ty++)
+    {
+        for (tx = 0; tx < d->tiles_x; tx++)
+        {
+            i = ty * d->tiles_x + tx;
+
+            for (y = ty - 1; y <= ty + 1 && !d->tile_hit[i]; y++)
+            {
+                for (x = tx - 1; x <= tx + 1; x++)
+                {
+                    if (y < 0 || y >= d->tiles_y || x < 0 || x >= d->tiles_x)
+                        continue;
+
+                    n = y * d->tiles_x + x;
+                    if (d->tile_recent[n])
+                    {
+                        d->tile_hit[i] = 1;
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+    d->probe_phase = (phase + PROBE_PHASE_STEP) % PROBE_INTERVAL;
+}
+
+/* Have the next update_screen() compare the tiles covering a rectangle
+ * (x2/y2 exclusive) in full, for callers that know where damage is. */
+static void flag_tiles(struct fb_display *d, int x1, int y1, int x2, int y2)
+{
+    int tx, ty;
+
+    if (x2 <= x1 || y2 <= y1)
+        return;
+
+    for (ty = y1 / PROBE_TILE; ty <= (y2 - 1) / PROBE_TILE; ty++)
+    {
+        for (tx = x1 / PROBE_TILE; tx <= (x2 - 1) / PROBE_TILE; tx++)
+            d->tile_hit[ty * d->tiles_x + tx] = 1;
+    }
+}
+
+static void update_screen(struct fb_display *d)
 {
 #ifdef LOG_FPS
     static int frames = 0;
@@ -556,67 +1720,64 @@ static void update_screen(void)
     }
 #endif
 
-    int x, y;
-    int xstep = 4/bytespp;
+    int xstep = 4/d->bytespp;
+    int i, sweep, changed;
 
-    uint32_t *f, *c, *r;
+    TRACE(update_start, (int)(d - displays));
+
+    d->varblock.min_x = d->varblock.min_y = 9999;
+    d->varblock.max_x = d->varblock.max_y = -1;
 
-    varblock.min_x = varblock.min_y = 9999;
-    varblock.max_x = varblock.max_y = -1;
+    sweep = !probe_scan || d->probe_frame++ % PROBE_SWEEP == 0;
 
-    f = (uint32_t *)fbmmap;        /* -> framebuffer         */
-    c = (uint32_t *)fbbuf;         /* -> compare framebuffer */
-    r = (uint32_t *)vncbuf;        /* -> remote framebuffer  */
+    if (!sweep)
+        probe_tiles(d);
 
-    for (y = 0; y < (int)scrinfo.yres; y++)
+    /* Age the recent damage now that the probes have used it */
+    for (i = 0; i < d->tiles_x * d->tiles_y; i++)
     {
-        /* Compare every 1/2/4 pixels at a time */
-        for (x = 0; x < (int)scrinfo.xres; x += xstep)
-        {
-            uint32_t pixel = *f;
+        if (d->tile_recent[i])
+            d->tile_recent[i]--;
+    }
 
-            if (pixel != *c)
-            {
-                *c = pixel;
+    changed = compare_tiles(d, sweep);
+    memset(d->tile_hit, 0, d->tiles_x * d->tiles_y);
 
-                /* Translate the pixel for the remote framebuffer */
-                *r = PIXEL_FB_TO_RFB(pixel,
-                         varblock.r_offset,
-                         varblock.g_offset,
-                         varblock.b_offset);
+    TRACE(update_end, (int)(d - displays), changed, sweep,
+          d->varblock.min_x, d->varblock.min_y,
+          d->varblock.max_x, d->varblock.max_y);
 
-                if (x < varblock.min_x)
-                    varblock.min_x = x;
-                else
-                {
-                    if (x > varblock.max_x)
-                        varblock.max_x = x;
+    if (changed)
+    {
+        int x2 = d->varblock.max_x + xstep;
 
-                    if (y > varblock.max_y)
-                        varblock.max_y = y;
-                    else if (y < varblock.min_y)
-                        varblock.min_y = y;
-                }
-            }
+        if (x2 > (int)d->scrinfo.xres)
+            x2 = d->scrinfo.xres;
 
-            f++;
-            c++;
-            r++;
+        if (record_file)
+        {
+            record_damage(d, d->varblock.min_x, d->varblock.min_y,
+                          x2, d->varblock.max_y + 1);
         }
-    }
 
-    if (varblock.min_x < 9999)
-    {
-        if (varblock.max_x < 0)
-            varblock.max_x = varblock.min_x;
+        if (d->shm)
+        {
+            shm_publish(d, d->varblock.min_x, d->varblock.min_y,
+                        x2, d->varblock.max_y + 1);
+        }
 
-        if (varblock.max_y < 0)
-            varblock.max_y = varblock.min_y;
+        if (d->lat_input)
+            latency_change(d);
 
-        rfbMarkRectAsModified(server, varblock.min_x - 2, varblock.min_y - 2,
-                              varblock.max_x + 2, varblock.max_y + 2);
+        TRACE(mark_rect, (int)(d - displays),
+              d->varblock.min_x - 2, d->varblock.min_y - 2,
+              d->varblock.max_x + 2, d->varblock.max_y + 2);
+        rfbMarkRectAsModified(d->server,
+                              d->varblock.min_x - 2, d->varblock.min_y - 2,
+                              d->varblock.max_x + 2, d->varblock.max_y + 2);
 
-        rfbProcessEvents(server, 10000);
+        TRACE(process_events, (int)(d - displays), flush_usec);
+        rfbProcessEvents(d->server, flush_usec);
     }
 }
 
@@ -669,16 +1830,16 @@ int input_finder(int max_num, const char **patterns, char **path)
     return device_id;
 }
 
-void input_search(void)
+void input_search(struct fb_display *d)
 {
     const int max_input_num = 20;
 
-    if (input_finder(max_input_num, KBD_PATTERNS, &kbd_device) < 0) {
+    if (!d->kbd_device && input_finder(max_input_num, KBD_PATTERNS, &d->kbd_device) < 0) {
         LOG1("Failed to auto-detect keyboard device.\nPlease manually specify (See -k flag).\n");
         exit(EXIT_FAILURE);
     }
 
-    if (input_finder(max_input_num, PTR_PATTERNS, &mouse_device) < 0) {
+    if (!d->mouse_device && input_finder(max_input_num, PTR_PATTERNS, &d->mouse_device) < 0) {
         LOG1("Failed to auto-detect mouse device.\nPlease manually specify (see -m flag).\n");
         exit(EXIT_FAILURE);
     }
@@ -687,25 +1848,228 @@ void input_search(void)
 void print_usage(char **argv)
 {
     fprintf(stdout, "Framebuffer VNC Server:     %s (%s)\n\n"
-                    "%s [-f device] [-k device] [-m device] [-p port] [-v|-vv] [-h]\n"
+                    "%s [-f device] [-k device] [-m device] [-p port] [-s path] [-R file] [-P file [-T] [-C count]] [-L] [-F] [-v|-vv] [-h]\n"
                     "-p port: VNC port, default is 5900\n"
                     "-f device: framebuffer device node, default is /dev/fb0\n"
                     "-k device: keyboard device node\n"
                     "-m device: mouse device node\n"
+                    "-R file: record the framebuffer damage to file\n"
+                    "-P file: play a recording back instead of reading framebuffers\n"
+                    "-T : play back in real time rather than as fast as possible\n"
+                    "-C count: wait for count VNC clients before playing back\n"
+                    "-L : report input-to-photon latency every 5 seconds\n"
+                    "-F : compare the whole framebuffer every frame instead of probing\n"
+                    "-s path: export frames through shared memory, handed out on\n"
+                    "         the Unix socket at path\n"
                     "-v : Verbose output, errors only (to stderr stream)\n"
                     "-vv : Very verbose output, errors and debugging (to stderr stream)\n"
                     "-h : print this help\n"
-            , GIT_BRANCH, GIT_COMMIT_HASH, *argv);
+                    "\n"
+                    "-f, -p, -s, -k and -m may be repeated (up to %d times) to serve several\n"
+                    "framebuffers from one process. The Nth -p, -s, -k or -m applies to the\n"
+                    "Nth -f; display N defaults to /dev/fbN on port 5900+N. Input devices\n"
+                    "are only auto-detected for the first display; input from clients of\n"
+                    "any other display without -k or -m is ignored.\n"
+            , GIT_BRANCH, GIT_COMMIT_HASH, *argv, MAX_DISPLAYS);
+}
+
+/*****************************************************************************/
+
+/* Wait up to usec for activity on any display's sockets, then let every
+ * display handle its pending client I/O. This replaces blocking in
+ * rfbProcessEvents() on a single screen, which would starve the others. */
+static void process_events(long usec)
+{
+    struct timeval tv;
+    fd_set fds;
+    int i, fd, maxfd = -1;
+
+    FD_ZERO(&fds);
+
+    for (i = 0; i < num_displays; i++)
+    {
+        rfbScreenInfoPtr server = displays[i].server;
+
+        for (fd = 0; fd <= server->maxFd; fd++)
+        {
+            if (FD_ISSET(fd, &server->allFds))
+            {
+                FD_SET(fd, &fds);
+                if (fd > maxfd)
+                    maxfd = fd;
+            }
+        }
+    }
+
+    shm_add_fds(&fds, &maxfd);
+
+    tv.tv_sec = usec / 1000000;
+    tv.tv_usec = usec % 1000000;
+
+    if (select(maxfd + 1, &fds, NULL, NULL, &tv) < 0 && errno != EINTR)
+    {
+        LOG1("select failed, %s\n", strerror(errno));
+        FD_ZERO(&fds);
+    }
+
+    shm_handle_fds(&fds);
+
+    for (i = 0; i < num_displays; i++)
+    {
+        TRACE(process_events, i, 0L);
+        rfbProcessEvents(displays[i].server, 0);
+    }
+}
+
+/* How many VNC clients are connected, over all displays. */
+static int count_clients(void)
+{
+    rfbClientIteratorPtr iter;
+    int i, clients = 0;
+
+    for (i = 0; i < num_displays; i++)
+    {
+        iter = rfbGetClientIterator(displays[i].server);
+        while (rfbClientIteratorNext(iter) != NULL)
+            clients++;
+        rfbReleaseClientIterator(iter);
+    }
+
+    return clients;
+}
+
+/* Whether any client still has damage libvncserver has not sent yet. */
+static int updates_pending(void)
+{
+    rfbClientIteratorPtr iter;
+    rfbClientPtr cl;
+    int i, pending = 0;
+
+    for (i = 0; i < num_displays && !pending; i++)
+    {
+        iter = rfbGetClientIterator(displays[i].server);
+        while ((cl = rfbClientIteratorNext(iter)) != NULL && !pending)
+            pending = !sraRgnEmpty(cl->modifiedRegion);
+        rfbReleaseClientIterator(iter);
+    }
+
+    return pending;
+}
+
+/* Feed a recording through update_screen() as if the framebuffers were
+ * drawing it live. */
+static void replay(void)
+{
+    struct rec_frame frame;
+    unsigned long frames = 0;
+    uint64_t start, now;
+    double elapsed;
+    int y, ok = 1;
+
+    /* Without clients libvncserver never encodes anything, so give them a
+     * chance to connect before the clock starts */
+    if (replay_clients > 0)
+        LOG1("Waiting for %d client(s) before replaying...\n", replay_clients);
+    while (running && count_clients() < replay_clients)
+        process_events(100000);
+
+    start = monotonic_usec();
+
+    while (running && ok &&
+           gzread(replay_gz, &frame, sizeof(frame)) == sizeof(frame))
+    {
+        struct fb_display *d;
+        size_t row, stride;
+
+        if (frame.display >= (uint32_t)num_displays ||
+            frame.w > displays[frame.display].scrinfo.xres ||
+            frame.h > displays[frame.display].scrinfo.yres ||
+            frame.x > displays[frame.display].scrinfo.xres - frame.w ||
+            frame.y > displays[frame.display].scrinfo.yres - frame.h)
+        {
+            LOG1("Error: corrupt frame in recording, stopping.\n");
+            break;
+        }
+
+        d = &displays[frame.display];
+        row = frame.w * d->bytespp;
+        stride = d->row_words * 4;
+
+        for (y = 0; y < (int)frame.h && ok; y++)
+        {
+            ok = gzread(replay_gz, (unsigned char *)d->fbmmap +
+                        (frame.y + y) * stride + frame.x * d->bytespp,
+                        row) == (int)row;
+        }
+
+        if (!ok)
+        {
+            LOG1("Error: recording is truncated, stopping.\n");
+            break;
+        }
+
+        /* Keep serving clients while waiting for the frame to be due. Wake
+         * up regularly like the live loop does, as libvncserver only sends
+         * deferred updates from a later rfbProcessEvents(). */
+        if (replay_realtime)
+        {
+            while (running && (now = monotonic_usec() - start) < frame.timestamp)
+            {
+                if (frame.timestamp - now > 100000)
+                    process_events(100000);
+                else
+                    process_events(frame.timestamp - now);
+            }
+        }
+        else
+            process_events(0);
+
+        /* No need to probe for damage we just wrote ourselves */
+        flag_tiles(d, frame.x, frame.y, frame.x + frame.w, frame.y + frame.h);
+        update_screen(d);
+        frames++;
+    }
+
+    elapsed = (monotonic_usec() - start) / 1000000.0;
+    LOG1("Replayed %lu frames in %.3f s (%.1f frames/s) with %d client(s) attached\n",
+         frames, elapsed, elapsed > 0 ? frames / elapsed : 0.0, count_clients());
+
+    /* Let the last frames reach the clients before returning, but do not
+     * wait forever on one that stopped asking for updates */
+    start = monotonic_usec();
+    while (running && updates_pending() &&
+           monotonic_usec() - start < REPLAY_DRAIN_USEC)
+    {
+        process_events(flush_usec > 0 ? flush_usec : 1000);
+    }
+}
+
+static void handle_signal(int sig)
+{
+    running = 0;
 }
 
 int main(int argc, char **argv)
 {
+    int num_devices = 0, num_ports = 0, num_shm = 0, num_kbds = 0, num_mice = 0;
+    int i, next = 0;
+
+    for (i = 0; i < MAX_DISPLAYS; i++)
+    {
+        displays[i].fbfd = -1;
+        displays[i].fbmmap = MAP_FAILED;
+        displays[i].kbdfd = -1;
+        displays[i].mousefd = -1;
+    }
+
     if(argc > 1)
     {
-        int i=1;
+        i = 1;
         while(i < argc)
         {
-            if(*argv[i] == '-')
+            /* Anything longer than -x, such as -sslkeyfile, is left for
+             * libvncserver */
+            if(*argv[i] == '-' && (strlen(argv[i]) == 2 || !strcmp(argv[i], "-vv")))
             {
                 switch(*(argv[i] + 1))
                 {
@@ -715,19 +2079,69 @@ int main(int argc, char **argv)
                     break;
                 case 'f':
                     i++;
-                    strcpy(fb_device, argv[i]);
+                    if (num_devices == MAX_DISPLAYS)
+                    {
+                        LOG1("Error: At most %d framebuffer devices are supported.\n", MAX_DISPLAYS);
+                        exit(EXIT_FAILURE);
+                    }
+                    strcpy(displays[num_devices++].fb_device, argv[i]);
                     break;
                 case 'k':
                     i++;
-                    kbd_device = argv[i];
+                    if (num_kbds == MAX_DISPLAYS)
+                    {
+                        LOG1("Error: At most %d keyboard devices are supported.\n", MAX_DISPLAYS);
+                        exit(EXIT_FAILURE);
+                    }
+                    displays[num_kbds++].kbd_device = argv[i];
                     break;
                 case 'm':
                     i++;
-                    mouse_device = argv[i];
+                    if (num_mice == MAX_DISPLAYS)
+                    {
+                        LOG1("Error: At most %d mouse devices are supported.\n", MAX_DISPLAYS);
+                        exit(EXIT_FAILURE);
+                    }
+                    displays[num_mice++].mouse_device = argv[i];
                     break;
                 case 'p':
                     i++;
-                    vnc_port = atoi(argv[i]);
+                    if (num_ports == MAX_DISPLAYS)
+                    {
+                        LOG1("Error: At most %d VNC ports are supported.\n", MAX_DISPLAYS);
+                        exit(EXIT_FAILURE);
+                    }
+                    displays[num_ports++].vnc_port = atoi(argv[i]);
+                    break;
+                case 's':
+                    i++;
+                    if (num_shm == MAX_DISPLAYS)
+                    {
+                        LOG1("Error: At most %d shared memory exports are supported.\n", MAX_DISPLAYS);
+                        exit(EXIT_FAILURE);
+                    }
+                    displays[num_shm++].shm_path = argv[i];
+                    break;
+                case 'R':
+                    i++;
+                    record_file = argv[i];
+                    break;
+                case 'P':
+                    i++;
+                    replay_file = argv[i];
+                    break;
+                case 'T':
+                    replay_realtime = 1;
+                    break;
+                case 'C':
+                    i++;
+                    replay_clients = atoi(argv[i]);
+                    break;
+                case 'L':
+                    latency_stats = 1;
+                    break;
+                case 'F':
+                    probe_scan = 0;
                     break;
                 case 'v':
                     if (*(argv[i] + 2) == 'v') {
@@ -743,35 +2157,130 @@ int main(int argc, char **argv)
         }
     }
 
-    /* Automagically find inputs, if not already specified */
-    input_search();
+    if (replay_file)
+    {
+        if (record_file)
+        {
+            LOG1("Error: Can not record while replaying.\n");
+            exit(EXIT_FAILURE);
+        }
 
-    LOG2("Initializing framebuffer device %s...\n", fb_device);
-    init_fb();
-    LOG2("Initializing keyboard device %s...\n", kbd_device);
-    init_kbd();
-    LOG2("Initializing mouse device %s...\n", mouse_device);
-    init_mouse();
+        /* The recording decides how many displays there are */
+        LOG2("Replaying %s...\n", replay_file);
+        init_replay();
+    }
+    else
+    {
+        /* One display per -f, -p, -s, -k or -m given, and at least one. */
+        num_displays = num_devices > num_ports ? num_devices : num_ports;
+        if (num_shm > num_displays)
+            num_displays = num_shm;
+        if (num_kbds > num_displays)
+            num_displays = num_kbds;
+        if (num_mice > num_displays)
+            num_displays = num_mice;
+        if (num_displays == 0)
+            num_displays = 1;
+
+        for (i = num_devices; i < num_displays; i++)
+            snprintf(displays[i].fb_device, PATH_MAX, "/dev/fb%d", i);
+    }
 
-    LOG2("Initializing VNC server:\n");
-    LOG2("	width:  %d\n", (int) scrinfo.xres);
-    LOG2("	height: %d\n", (int) scrinfo.yres);
-    LOG2("	bpp:    %d\n", (int) scrinfo.bits_per_pixel);
-    LOG2("	port:   %d\n", (int) vnc_port);
-    init_fb_server(argc, argv);
+    for (i = num_ports; i < num_displays; i++)
+        displays[i].vnc_port = DEFAULT_VNC_PORT + i;
 
-    /* Implement our own event loop to detect changes in the framebuffer. */
-    while (1)
+    if (!replay_file)
     {
-        while (server->clientHead == NULL)
-            rfbProcessEvents(server, 100000);
+        /* Automagically find inputs for the first display, if not already
+         * specified. The others only get the ones they are given. */
+        input_search(&displays[0]);
+
+        for (i = 0; i < num_displays; i++)
+        {
+            struct fb_display *d = &displays[i];
+
+            LOG2("Initializing framebuffer device %s...\n", d->fb_device);
+            init_fb(d);
+
+            if (d->kbd_device)
+            {
+                LOG2("Initializing keyboard device %s...\n", d->kbd_device);
+                init_kbd(d);
+            }
+            else
+                LOG2("No keyboard for %s, ignoring its key events\n", d->fb_device);
 
-        rfbProcessEvents(server, 100000);
-        update_screen();
+            if (d->mouse_device)
+            {
+                LOG2("Initializing mouse device %s...\n", d->mouse_device);
+                init_mouse(d);
+            }
+            else
+                LOG2("No mouse for %s, ignoring its pointer events\n", d->fb_device);
+        }
     }
 
+    for (i = 0; i < num_displays; i++)
+    {
+        struct fb_display *d = &displays[i];
+
+        LOG2("Initializing VNC server for %s:\n", d->fb_device);
+        LOG2("	width:  %d\n", (int) d->scrinfo.xres);
+        LOG2("	height: %d\n", (int) d->scrinfo.yres);
+        LOG2("	bpp:    %d\n", (int) d->scrinfo.bits_per_pixel);
+        LOG2("	port:   %d\n", (int) d->vnc_port);
+        init_fb_server(d, argc, argv);
+    }
+
+    if (record_file)
+    {
+        LOG2("Recording to %s...\n", record_file);
+        init_recorder();
+    }
+
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+
+    /* Implement our own event loop to detect changes in the framebuffers.
+     * All displays share it; the display scanned first rotates every pass so
+     * that none of them is consistently served last. A display is scanned
+     * while it has VNC clients or shared memory subscribers, and always while
+     * recording. Any damage missed while not scanning is picked up by a full
+     * sweep when scanning resumes. */
+    if (replay_file)
+        replay();
+
+    while (running && !replay_file)
+    {
+        process_events(100000);
+
+        for (i = 0; i < num_displays; i++)
+        {
+            struct fb_display *d = &displays[(next + i) % num_displays];
+
+            if (d->server->clientHead != NULL || record_file || d->num_shm_subs > 0)
+                update_screen(d);
+            else
+                d->probe_frame = 0;     /* sweep once scanning resumes */
+        }
+
+        next = (next + 1) % num_displays;
+
+        if (latency_stats)
+            latency_report(0);
+    }
+
+    if (latency_stats)
+        latency_report(1);
+
     LOG2("Cleaning up...\n");
-    cleanup_fb();
-    cleanup_kbd();
-    cleanup_mouse();
+    cleanup_recorder();
+    cleanup_replay();
+    for (i = 0; i < num_displays; i++)
+    {
+        cleanup_shm(&displays[i]);
+        cleanup_fb(&displays[i]);
+        cleanup_kbd(&displays[i]);
+        cleanup_mouse(&displays[i]);
+    }
 }